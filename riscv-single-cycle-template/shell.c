@@ -8,6 +8,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
 #include "shell.h"
 
 // main memory
@@ -38,43 +45,109 @@ char *reg_mnemonic[RISCV_REGS] = {"zero", "ra", "sp", "gp", "tp", "t0", "t1", "t
 CPU_State CURRENT_STATE, NEXT_STATE;
 int RUN_BIT;	/* run bit */
 int INSTRUCTION_COUNT;
+int RETIRE_LIMIT = 1;
 
 FILE *dumpsim_file;
 
-uint32_t mem_read_32(uint32_t address)
+/*
+  Region buffers hold memory in native little-endian order, so an
+  aligned access is a single host load/store. Accesses that are
+  misaligned or run off the end of a region are split into bytes;
+  unmapped bytes read as zero and ignore writes.
+*/
+static uint8_t *mem_lookup(uint32_t address, uint32_t size)
 {
   int i;
   for (i = 0; i < MEM_NREGIONS; i++) {
+    /* 64-bit end: the stack region runs past 0xffffffff */
     if (address >= MEM_REGIONS[i].start &&
-	address < (MEM_REGIONS[i].start + MEM_REGIONS[i].size)) {
-      uint32_t offset = address - MEM_REGIONS[i].start;
-      
-      return
-	(MEM_REGIONS[i].mem[offset+3] << 0) |
-	(MEM_REGIONS[i].mem[offset+2] << 8) |
-	(MEM_REGIONS[i].mem[offset+1] << 16) |
-	(MEM_REGIONS[i].mem[offset+0] << 24);
-    }
+	(uint64_t)address + size <=
+	(uint64_t)MEM_REGIONS[i].start + MEM_REGIONS[i].size)
+      return MEM_REGIONS[i].mem + (address - MEM_REGIONS[i].start);
   }
-  
-  return 0;
+
+  return NULL;
+}
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define MEM_LE16(x) __builtin_bswap16(x)
+#define MEM_LE32(x) __builtin_bswap32(x)
+#else
+#define MEM_LE16(x) (x)
+#define MEM_LE32(x) (x)
+#endif
+
+uint8_t mem_read_8(uint32_t address)
+{
+  uint8_t *p = mem_lookup(address, 1);
+  return p ? *p : 0;
+}
+
+void mem_write_8(uint32_t address, uint8_t value)
+{
+  uint8_t *p = mem_lookup(address, 1);
+  if (p)
+    *p = value;
+}
+
+uint16_t mem_read_16(uint32_t address)
+{
+  uint8_t *p;
+  uint16_t value;
+
+  if ((address & 1) == 0 && (p = mem_lookup(address, 2)) != NULL) {
+    memcpy(&value, p, sizeof(value));
+    return MEM_LE16(value);
+  }
+
+  return mem_read_8(address) | (mem_read_8(address + 1) << 8);
+}
+
+void mem_write_16(uint32_t address, uint16_t value)
+{
+  uint8_t *p;
+
+  if ((address & 1) == 0 && (p = mem_lookup(address, 2)) != NULL) {
+    value = MEM_LE16(value);
+    memcpy(p, &value, sizeof(value));
+    return;
+  }
+
+  mem_write_8(address, value & 0xFF);
+  mem_write_8(address + 1, (value >> 8) & 0xFF);
+}
+
+uint32_t mem_read_32(uint32_t address)
+{
+  uint8_t *p;
+  uint32_t value;
+
+  if ((address & 3) == 0 && (p = mem_lookup(address, 4)) != NULL) {
+    memcpy(&value, p, sizeof(value));
+    return MEM_LE32(value);
+  }
+
+  return
+    ((uint32_t)mem_read_8(address + 0) << 0) |
+    ((uint32_t)mem_read_8(address + 1) << 8) |
+    ((uint32_t)mem_read_8(address + 2) << 16) |
+    ((uint32_t)mem_read_8(address + 3) << 24);
 }
 
 void mem_write_32(uint32_t address, uint32_t value)
 {
-  int i;
-  for (i = 0; i < MEM_NREGIONS; i++) {
-    if (address >= MEM_REGIONS[i].start &&
-	address < (MEM_REGIONS[i].start + MEM_REGIONS[i].size)) {
-      uint32_t offset = address - MEM_REGIONS[i].start;
-      
-      MEM_REGIONS[i].mem[offset+3] = (value >> 0) & 0xFF;
-      MEM_REGIONS[i].mem[offset+2] = (value >> 8) & 0xFF;
-      MEM_REGIONS[i].mem[offset+1] = (value >> 16) & 0xFF;
-      MEM_REGIONS[i].mem[offset+0] = (value >> 24) & 0xFF;
-      return;
-    }
+  uint8_t *p;
+
+  if ((address & 3) == 0 && (p = mem_lookup(address, 4)) != NULL) {
+    value = MEM_LE32(value);
+    memcpy(p, &value, sizeof(value));
+    return;
   }
+
+  mem_write_8(address + 0, (value >> 0) & 0xFF);
+  mem_write_8(address + 1, (value >> 8) & 0xFF);
+  mem_write_8(address + 2, (value >> 16) & 0xFF);
+  mem_write_8(address + 3, (value >> 24) & 0xFF);
 }
 
 int help(char **args) {                                                    
@@ -84,6 +157,7 @@ int help(char **args) {
   printf("mdump low high   -  dump memory from low to high      \n");
   printf("rdump            -  dump the register & bus values    \n");
   printf("input reg_no reg_value - set GPR reg_no to reg_value  \n");
+  printf("fusion           -  show fused instruction counts     \n");
   printf("?                -  display this help menu            \n");
   printf("quit             -  exit the program                  \n\n");
   return 1;
@@ -97,7 +171,7 @@ void cycle() {
 
 int run(char **args) {
   int num_cycles;
-  int i;
+  int start;
 
   if (args[1] == NULL) {
     printf("Incorrect run cmd: missing # of instrucitons to run\n\n");
@@ -116,11 +190,14 @@ int run(char **args) {
   }
 
   printf("Simulating for %d cycles...\n\n", num_cycles);
-  for (i = 0; i < num_cycles; i++) {
+  start = INSTRUCTION_COUNT;
+  while (INSTRUCTION_COUNT - start < num_cycles) {
     if (RUN_BIT == FALSE) {
       printf("Simulator halted\n\n");
       break;
     }
+    /* a fused cycle retires two instructions; don't overshoot n */
+    RETIRE_LIMIT = num_cycles - (INSTRUCTION_COUNT - start);
     cycle();
   }
 
@@ -134,6 +211,7 @@ int go(char **args) {
   }
 
   printf("Simulating...\n\n");
+  RETIRE_LIMIT = INT_MAX;
   while (RUN_BIT)
     cycle();
   printf("Simulator halted\n\n");
@@ -247,6 +325,11 @@ void initialize(char *program_filename, int num_prog_files) {
   RUN_BIT = TRUE;
 }
 
+int fusion(char **args) {
+  print_fusion_stats();
+  return 1;
+}
+
 int exit_shell(char **args)
 {
   printf("Bye.\n");
@@ -296,7 +379,8 @@ char *builtin_str[] = {
   "rdump",
   "i",
   "I",
-  "input"
+  "input",
+  "fusion"
 };
 
 int (*builtin_func[]) (char **) = {
@@ -316,7 +400,8 @@ int (*builtin_func[]) (char **) = {
   &rdump,
   &input_cmd,
   &input_cmd,
-  &input_cmd
+  &input_cmd,
+  &fusion
 };
 
 int num_builtins() {
@@ -430,6 +515,310 @@ char **split_line(char *line)
   return tokens;
 }
 
+/*
+  Regression mode: every program file is an independent test, run in its
+  own worker process. A test's golden file (<program_file>.golden) is the
+  dumpsim output of an interactive session that ran "go", then "rdump",
+  then any number of "mdump low high" commands. The worker reruns the
+  program, repeats the same dumps and compares the result byte for byte;
+  on a mismatch the actual output is left in <program_file>.actual.
+*/
+#define REGRESS_PASS    0
+#define REGRESS_FAIL    1
+#define REGRESS_ERROR   2
+#define REGRESS_TIMEOUT 3
+
+#define REGRESS_MAX_INSTRUCTIONS 10000000
+#define REGRESS_TIMEOUT_SECONDS  60
+
+typedef struct {
+  char *program;
+  pid_t pid;
+  struct timespec start;
+  double ms;
+  int result;
+} regress_test_t;
+
+/**
+   @brief Read a whole file into memory.
+   @param path File name.
+   @param len Set to the number of bytes read.
+   @return Malloc'd buffer, or NULL if the file can't be read.
+*/
+char *read_file(const char *path, long *len)
+{
+  FILE *f = fopen(path, "rb");
+  char *buf;
+
+  if (f == NULL)
+    return NULL;
+  fseek(f, 0, SEEK_END);
+  *len = ftell(f);
+  rewind(f);
+  buf = malloc(*len + 1);
+  if (buf == NULL || fread(buf, 1, *len, f) != (size_t)*len) {
+    free(buf);
+    fclose(f);
+    return NULL;
+  }
+  buf[*len] = '\0';
+  fclose(f);
+  return buf;
+}
+
+/**
+   @brief Write a buffer to a file, replacing its contents.
+*/
+int write_file(const char *path, const char *buf, long len)
+{
+  FILE *f = fopen(path, "wb");
+  int ok;
+
+  if (f == NULL)
+    return 0;
+  ok = fwrite(buf, 1, len, f) == (size_t)len;
+  return fclose(f) == 0 && ok;
+}
+
+/**
+   @brief Run one test to completion inside a worker process.
+   @return One of the REGRESS_* codes, used as the worker's exit status.
+*/
+int regress_one(char *program, int max_instructions, int update)
+{
+  char path[4096], actual_path[4096], low[16], high[16];
+  char *mdump_args[] = { "mdump", low, high, NULL };
+  char *golden, *actual, *line;
+  long golden_len = 0, actual_len;
+  unsigned int lo, hi;
+  FILE *prog;
+
+  /* report this before stdout goes away; load_program's message would be lost */
+  if ((prog = fopen(program, "r")) == NULL) {
+    fprintf(stderr, "%s: can't open program file\n", program);
+    return REGRESS_ERROR;
+  }
+  fclose(prog);
+
+  /* the per-instruction trace is of no use here */
+  if (freopen("/dev/null", "w", stdout) == NULL)
+    return REGRESS_ERROR;
+
+  snprintf(path, sizeof(path), "%s.golden", program);
+  snprintf(actual_path, sizeof(actual_path), "%s.actual", program);
+  golden = read_file(path, &golden_len);
+  if (golden == NULL && !update) {
+    fprintf(stderr, "%s: missing golden file %s\n", program, path);
+    return REGRESS_ERROR;
+  }
+
+  init_memory();
+  load_program(program);
+  NEXT_STATE = CURRENT_STATE;
+  RUN_BIT = TRUE;
+  while (RUN_BIT && INSTRUCTION_COUNT < max_instructions) {
+    RETIRE_LIMIT = max_instructions - INSTRUCTION_COUNT;
+    cycle();
+  }
+  if (RUN_BIT) {
+    fprintf(stderr, "%s: not halted after %d instructions\n",
+            program, max_instructions);
+    return REGRESS_TIMEOUT;
+  }
+
+  if ((dumpsim_file = tmpfile()) == NULL)
+    return REGRESS_ERROR;
+  rdump(NULL);
+  for (line = golden; line != NULL; line = strchr(line, '\n')) {
+    if (*line == '\n')
+      line++;
+    if (strncmp(line, "Memory content [", 16) == 0 &&
+        sscanf(line, "Memory content [0x%x..0x%x] :", &lo, &hi) == 2) {
+      snprintf(low, sizeof(low), "%x", lo);
+      snprintf(high, sizeof(high), "%x", hi);
+      mdump(mdump_args);
+    }
+  }
+
+  actual_len = ftell(dumpsim_file);
+  actual = malloc(actual_len);
+  rewind(dumpsim_file);
+  if (actual == NULL ||
+      fread(actual, 1, actual_len, dumpsim_file) != (size_t)actual_len)
+    return REGRESS_ERROR;
+
+  /* a .actual left by an earlier failing run would look like a current failure */
+  if (update) {
+    unlink(actual_path);
+    return write_file(path, actual, actual_len) ? REGRESS_PASS : REGRESS_ERROR;
+  }
+
+  if (actual_len == golden_len && memcmp(actual, golden, actual_len) == 0) {
+    unlink(actual_path);
+    return REGRESS_PASS;
+  }
+
+  write_file(actual_path, actual, actual_len);
+  return REGRESS_FAIL;
+}
+
+double elapsed_ms(struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1e3 +
+         (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/**
+   @brief Parse a decimal option value.
+   @param str Option argument.
+   @param min Smallest accepted value.
+   @param value Set to the parsed value.
+   @return 1 if str is a whole number in [min, INT_MAX], 0 otherwise.
+*/
+int parse_count(const char *str, int min, int *value)
+{
+  char *end;
+  long n;
+
+  errno = 0;
+  n = strtol(str, &end, 10);
+  if (errno != 0 || end == str || *end != '\0' || n < min || n > INT_MAX)
+    return 0;
+  *value = n;
+  return 1;
+}
+
+int regress_usage()
+{
+  printf("Error: usage: -regress [-j n] [-max n] [-timeout s] [-update] "
+         "<program_file_1> <program_file_2> ...\n");
+  return 1;
+}
+
+/**
+   @brief Run every program as an independent test, several at a time.
+   @param args Options followed by the program files:
+               -j n        number of parallel workers (default: #cpus)
+               -max n      instruction limit per test
+               -timeout s  wall-clock limit per test in seconds (0: none)
+               -update     (re)write the golden files from this run
+   @return Process exit status: 0 if every test passed.
+*/
+int regress(int argc, char **argv)
+{
+  static const char *result_str[] = { "PASS", "FAIL", "ERROR", "TIMEOUT" };
+  int jobs = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_instructions = REGRESS_MAX_INSTRUCTIONS;
+  int timeout = REGRESS_TIMEOUT_SECONDS;
+  int update = FALSE;
+  int num_tests, next = 0, running = 0, i, status;
+  int counts[4] = { 0, 0, 0, 0 };
+  regress_test_t *tests;
+  struct timespec start;
+  pid_t pid;
+
+  while (argc > 0 && argv[0][0] == '-') {
+    if (strcmp(argv[0], "-j") == 0 && argc > 1) {
+      if (!parse_count(argv[1], 1, &jobs))
+        return regress_usage();
+      argc--, argv++;
+    } else if (strcmp(argv[0], "-max") == 0 && argc > 1) {
+      if (!parse_count(argv[1], 1, &max_instructions))
+        return regress_usage();
+      argc--, argv++;
+    } else if (strcmp(argv[0], "-timeout") == 0 && argc > 1) {
+      if (!parse_count(argv[1], 0, &timeout))
+        return regress_usage();
+      argc--, argv++;
+    } else if (strcmp(argv[0], "-update") == 0) {
+      update = TRUE;
+    } else {
+      printf("Error: unknown regression option %s\n", argv[0]);
+      return regress_usage();
+    }
+    argc--, argv++;
+  }
+  if (jobs < 1)
+    jobs = 1;
+  if (argc < 1)
+    return regress_usage();
+
+  num_tests = argc;
+  if (jobs > num_tests)
+    jobs = num_tests;
+  tests = calloc(num_tests, sizeof(regress_test_t));
+  if (!tests) {
+    fprintf(stderr, "regress: allocation error\n");
+    exit(EXIT_FAILURE);
+  }
+  /* a test only passes once its worker has been reaped with a PASS status */
+  for (i = 0; i < num_tests; i++) {
+    tests[i].program = argv[i];
+    tests[i].result = REGRESS_ERROR;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  fflush(stdout);
+  while (next < num_tests || running > 0) {
+    /* keep up to jobs workers busy */
+    while (next < num_tests && running < jobs) {
+      clock_gettime(CLOCK_MONOTONIC, &tests[next].start);
+      pid = fork();
+      if (pid == 0) {
+        /* -max can't catch a worker stuck outside cycle(), e.g. in load_program */
+        alarm(timeout);
+        exit(regress_one(argv[next], max_instructions, update));
+      }
+      if (pid < 0) {
+        perror("regress: fork");
+      } else {
+        tests[next].pid = pid;
+        running++;
+      }
+      next++;
+    }
+
+    pid = wait(&status);
+    if (pid < 0)
+      break;
+    for (i = 0; i < next; i++) {
+      if (tests[i].pid == pid) {
+        tests[i].ms = elapsed_ms(&tests[i].start);
+        if (WIFEXITED(status) && WEXITSTATUS(status) <= REGRESS_TIMEOUT) {
+          tests[i].result = WEXITSTATUS(status);
+        } else if (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM) {
+          fprintf(stderr, "%s: killed after %d seconds\n",
+                  tests[i].program, timeout);
+          tests[i].result = REGRESS_TIMEOUT;
+        } else {
+          tests[i].result = REGRESS_ERROR;
+        }
+        running--;
+        break;
+      }
+    }
+  }
+
+  printf("\nRegression results:\n");
+  printf("-------------------------------------\n");
+  for (i = 0; i < num_tests; i++) {
+    printf("%-8s %10.3f ms  %s\n", result_str[tests[i].result], tests[i].ms,
+           tests[i].program);
+    counts[tests[i].result]++;
+  }
+  printf("\n%d tests: %d passed, %d failed, %d errors, %d timed out "
+         "(%.3f ms, %d workers)\n\n",
+         num_tests, counts[REGRESS_PASS], counts[REGRESS_FAIL],
+         counts[REGRESS_ERROR], counts[REGRESS_TIMEOUT],
+         elapsed_ms(&start), jobs);
+
+  free(tests);
+  return counts[REGRESS_PASS] == num_tests ? 0 : 1;
+}
+
 int main (int argc, char *argv[]) {                              
   int status;
   char *line;
@@ -439,9 +828,14 @@ int main (int argc, char *argv[]) {
   if (argc < 2) {
     printf("Error: usage: %s <program_file_1> <program_file_2> ...\n",
            argv[0]);
+    printf("       %s -regress [-j n] [-max n] [-timeout s] [-update] <program_file_1> ...\n",
+           argv[0]);
     exit(1);
   }
 
+  if (strcmp(argv[1], "-regress") == 0)
+    exit(regress(argc - 2, argv + 2));
+
   printf("RISCV Simulator\n\n");
 
   initialize(argv[1], argc - 1);
@@ -35,11 +35,18 @@ enum Opcode {SPECIAL, J};
 extern CPU_State CURRENT_STATE, NEXT_STATE;
 
 extern int RUN_BIT;	/* run bit */
+extern int INSTRUCTION_COUNT;
+extern int RETIRE_LIMIT;	/* max instructions one process_instruction() may retire */
 
+uint8_t  mem_read_8(uint32_t address);
+uint16_t mem_read_16(uint32_t address);
 uint32_t mem_read_32(uint32_t address);
+void     mem_write_8(uint32_t address, uint8_t value);
+void     mem_write_16(uint32_t address, uint16_t value);
 void     mem_write_32(uint32_t address, uint32_t value);
 
 /* YOU IMPLEMENT THIS FUNCTION */
 void process_instruction();
+void print_fusion_stats();
 
 #endif
@@ -10,6 +10,44 @@ static int rd, rs1, rs2;
 static int funct3, funct7;
 static int imm;
 
+// Fused instruction pairs recognized over the predecoded stream
+enum {
+    FUSE_UNKNOWN,     // pair not classified yet
+    FUSE_NEVER,       // opcode can't start a pair; the next word is never read
+    FUSE_NONE,        // no fusion with the current next word
+    FUSE_LUI_ADDI,    // li rd, imm32
+    FUSE_AUIPC_ADDI,  // la rd, symbol
+    FUSE_ADDI_BNE,    // loop counter update + test
+    FUSE_SLLI_ADD,    // scaled index
+    FUSE_KINDS
+};
+
+static const char *fusion_name[FUSE_KINDS] = {
+    "unknown", "never", "none", "LUI+ADDI", "AUIPC+ADDI", "ADDI+BNE", "SLLI+ADD"
+};
+
+// Number of fused pairs executed, per kind
+static unsigned long fusion_hits[FUSE_KINDS];
+
+// Predecoded instruction, cached by PC so a re-executed instruction
+// skips field extraction and its fusion check.
+typedef struct {
+    int valid;
+    uint32_t pc;
+    uint32_t instruction;  // raw word, compared on every hit in case the text was overwritten
+    uint32_t next;         // raw word at pc + 4 the fusion kind was computed against
+    int known;             // opcode is implemented
+    int opcode;
+    int rd, rs1, rs2;
+    int funct3, funct7;
+    int imm;
+    int fusion;
+} predecoded_t;
+
+#define PREDECODE_SIZE 4096  // entries, must be a power of two
+
+static predecoded_t predecode[PREDECODE_SIZE];
+
 // Fetch: Read a 32-bit instruction from memory using the current PC
 void fetch() {
     // Read the instruction using a 64-bit address
@@ -21,92 +59,214 @@ void fetch() {
 
 }
 
-// Decode: Extract the fields from the instruction.
-void decode() {
+// Extract the fields of one instruction word into a predecode entry.
+static void decode_fields(uint32_t word, predecoded_t *d) {
     // Clear all fields.
-    rd = rs1 = rs2 = funct3 = funct7 = imm = 0;
+    d->rd = d->rs1 = d->rs2 = d->funct3 = d->funct7 = d->imm = 0;
+    d->known = 1;
     // Extract the opcode from bits [6:0].
-    opcode = instruction & 0x7F;
+    d->opcode = word & 0x7F;
 
-    // If the instruction is all zeros, treat it as HLT.
-    if (opcode == 0x00) {
-        RUN_BIT = 0;
-        return;
-    }
-
-    switch (opcode) {
+    switch (d->opcode) {
 
         case 0x37:  // LUI (U-type): rd = immediate.
-            rd  = (instruction >> 7) & 0x1F;
-            imm = instruction & 0xFFFFF000;
+            d->rd  = (word >> 7) & 0x1F;
+            d->imm = word & 0xFFFFF000;
             break;
             
         case 0x17:  // AUIPC (U-type): rd = PC + immediate.
-            rd  = (instruction >> 7) & 0x1F;
-            imm = instruction & 0xFFFFF000;
+            d->rd  = (word >> 7) & 0x1F;
+            d->imm = word & 0xFFFFF000;
             break;
             
         case 0x13:  // I-type instructions (like ADDI and SLLI)
-            rd     = (instruction >> 7) & 0x1F;
-            funct3 = (instruction >> 12) & 0x07;
-            rs1    = (instruction >> 15) & 0x1F;
-            if (funct3 == 0x1) {  // SLLI: shift amount is in bits [24:20]
-                imm    = (instruction >> 20) & 0x1F;  // shift amount
-                funct7 = (instruction >> 25) & 0x7F;
+            d->rd     = (word >> 7) & 0x1F;
+            d->funct3 = (word >> 12) & 0x07;
+            d->rs1    = (word >> 15) & 0x1F;
+            if (d->funct3 == 0x1) {  // SLLI: shift amount is in bits [24:20]
+                d->imm    = (word >> 20) & 0x1F;  // shift amount
+                d->funct7 = (word >> 25) & 0x7F;
             } else {
-                imm = (instruction >> 20) & 0xFFF;
+                d->imm = (word >> 20) & 0xFFF;
                 // Sign-extend the 12-bit immediate
-                if (imm & 0x800)
-                    imm |= 0xFFFFF000;
+                if (d->imm & 0x800)
+                    d->imm |= 0xFFFFF000;
             }
             break;
             
         case 0x33:  // R-type: arithmetic/logic instructions
-            rd     = (instruction >> 7) & 0x1F;
-            funct3 = (instruction >> 12) & 0x07;
-            rs1    = (instruction >> 15) & 0x1F;
-            rs2    = (instruction >> 20) & 0x1F;
-            funct7 = (instruction >> 25) & 0x7F;
+            d->rd     = (word >> 7) & 0x1F;
+            d->funct3 = (word >> 12) & 0x07;
+            d->rs1    = (word >> 15) & 0x1F;
+            d->rs2    = (word >> 20) & 0x1F;
+            d->funct7 = (word >> 25) & 0x7F;
             break;
             
         case 0x23:  // S-type: store instructions (like  SW)
-            funct3 = (instruction >> 12) & 0x07;
-            rs1    = (instruction >> 15) & 0x1F;
-            rs2    = (instruction >> 20) & 0x1F;
+            d->funct3 = (word >> 12) & 0x07;
+            d->rs1    = (word >> 15) & 0x1F;
+            d->rs2    = (word >> 20) & 0x1F;
             {
-                int imm11_5 = (instruction >> 25) & 0x7F;
-                int imm4_0  = (instruction >> 7)  & 0x1F;
-                imm = (imm11_5 << 5) | imm4_0;
-                if (imm & 0x800)
-                    imm |= 0xFFFFF000;
+                int imm11_5 = (word >> 25) & 0x7F;
+                int imm4_0  = (word >> 7)  & 0x1F;
+                d->imm = (imm11_5 << 5) | imm4_0;
+                if (d->imm & 0x800)
+                    d->imm |= 0xFFFFF000;
             }
             break;
             
         case 0x63:  // B-type: branch instructions
-            funct3 = (instruction >> 12) & 0x07;
-            rs1    = (instruction >> 15) & 0x1F;
-            rs2    = (instruction >> 20) & 0x1F;
+            d->funct3 = (word >> 12) & 0x07;
+            d->rs1    = (word >> 15) & 0x1F;
+            d->rs2    = (word >> 20) & 0x1F;
             {
-                int bit12    = (instruction >> 31) & 0x1;
-                int bit11    = (instruction >> 7)  & 0x1;
-                int bits10_5 = (instruction >> 25) & 0x3F;
-                int bits4_1  = (instruction >> 8)  & 0xF;
-                imm = (bit12 << 12) | (bit11 << 11) | (bits10_5 << 5) | (bits4_1 << 1);
-                if (imm & 0x1000)
-                    imm |= 0xFFFFE000;  // sign-extend 13-bit immediate
+                int bit12    = (word >> 31) & 0x1;
+                int bit11    = (word >> 7)  & 0x1;
+                int bits10_5 = (word >> 25) & 0x3F;
+                int bits4_1  = (word >> 8)  & 0xF;
+                d->imm = (bit12 << 12) | (bit11 << 11) | (bits10_5 << 5) | (bits4_1 << 1);
+                if (d->imm & 0x1000)
+                    d->imm |= 0xFFFFE000;  // sign-extend 13-bit immediate
             }
             break;
             
         default:
-            printf("Decode: Unknown or unimplemented opcode: 0x%02X\n", opcode);
+            d->known = 0;
             break;
     }
+}
+
+// Return the predecode entry for the word at pc, decoding it on a miss.
+static predecoded_t *predecode_lookup(uint32_t pc, uint32_t word) {
+    predecoded_t *d = &predecode[(pc >> 2) & (PREDECODE_SIZE - 1)];
+
+    if (!d->valid || d->pc != pc || d->instruction != word) {
+        decode_fields(word, d);
+        d->valid = 1;
+        d->pc = pc;
+        d->instruction = word;
+        // Only LUI, AUIPC, ADDI and SLLI start a fused pair
+        if (d->opcode == 0x37 || d->opcode == 0x17 ||
+            (d->opcode == 0x13 && (d->funct3 == 0x0 || d->funct3 == 0x1)))
+            d->fusion = FUSE_UNKNOWN;
+        else
+            d->fusion = FUSE_NEVER;
+    }
+    return d;
+}
+
+// Decode: Load the predecoded fields of the fetched instruction.
+void decode(const predecoded_t *d) {
+    rd     = d->rd;
+    rs1    = d->rs1;
+    rs2    = d->rs2;
+    funct3 = d->funct3;
+    funct7 = d->funct7;
+    imm    = d->imm;
+    opcode = d->opcode;
+
+    // If the instruction is all zeros, treat it as HLT.
+    if (opcode == 0x00) {
+        RUN_BIT = 0;
+        return;
+    }
+
+    if (!d->known)
+        printf("Decode: Unknown or unimplemented opcode: 0x%02X\n", opcode);
 
     // Debug: print decoded opcode and fields
     printf("Decoded: opcode=0x%02X, rd=%d, rs1=%d, rs2=%d, funct3=0x%X, funct7=0x%X, imm=0x%X\n",
            opcode, rd, rs1, rs2, funct3, funct7, imm);
 }
 
+// Classify the pair (a, b) as one of the fused idioms. The second
+// instruction must consume the first one's result.
+static int fusion_kind(const predecoded_t *a, const predecoded_t *b) {
+    int addi_b = (b->opcode == 0x13 && b->funct3 == 0x0);
+
+    if (a->opcode == 0x37 && addi_b && b->rs1 == a->rd)
+        return FUSE_LUI_ADDI;
+    if (a->opcode == 0x17 && addi_b && b->rs1 == a->rd)
+        return FUSE_AUIPC_ADDI;
+    if (a->opcode == 0x13 && a->funct3 == 0x0 &&
+        b->opcode == 0x63 && b->funct3 == 0x1 &&
+        (b->rs1 == a->rd || b->rs2 == a->rd))
+        return FUSE_ADDI_BNE;
+    if (a->opcode == 0x13 && a->funct3 == 0x1 && a->funct7 == 0x00 &&
+        b->opcode == 0x33 && b->funct3 == 0x0 && b->funct7 == 0x00 &&
+        (b->rs1 == a->rd || b->rs2 == a->rd))
+        return FUSE_SLLI_ADD;
+    return FUSE_NONE;
+}
+
+// Execute the pair starting at d as one fused instruction. The second
+// half reads NEXT_STATE, which already holds the first half's result,
+// so the outcome matches two separate cycles. Returns 0 if no fusion
+// applies.
+static int execute_fused(predecoded_t *d) {
+    uint32_t pc = CURRENT_STATE.PC;
+    uint32_t next_word;
+    predecoded_t *n;
+
+    if (d->fusion == FUSE_NEVER)
+        return 0;
+    next_word = mem_read_32(pc + 4);
+    n = predecode_lookup(pc + 4, next_word);
+    if (d->fusion == FUSE_UNKNOWN || d->next != next_word) {
+        d->fusion = fusion_kind(d, n);
+        d->next = next_word;
+    }
+    if (d->fusion == FUSE_NONE)
+        return 0;
+
+    printf("Fused %s: 0x%08X 0x%08X at PC = 0x%08X\n",
+           fusion_name[d->fusion], d->instruction, n->instruction, pc);
+
+    NEXT_STATE.PC = pc + 8;
+    switch (d->fusion) {
+        case FUSE_LUI_ADDI:
+            NEXT_STATE.REGS[d->rd] = d->imm;
+            NEXT_STATE.REGS[n->rd] = d->imm + n->imm;
+            break;
+
+        case FUSE_AUIPC_ADDI:
+            NEXT_STATE.REGS[d->rd] = pc + d->imm;
+            NEXT_STATE.REGS[n->rd] = pc + d->imm + n->imm;
+            break;
+
+        case FUSE_ADDI_BNE:
+            NEXT_STATE.REGS[d->rd] = CURRENT_STATE.REGS[d->rs1] + d->imm;
+            if (NEXT_STATE.REGS[n->rs1] != NEXT_STATE.REGS[n->rs2])
+                NEXT_STATE.PC = pc + 4 + n->imm;
+            break;
+
+        case FUSE_SLLI_ADD:
+            NEXT_STATE.REGS[d->rd] = CURRENT_STATE.REGS[d->rs1] << d->imm;
+            NEXT_STATE.REGS[n->rd] = NEXT_STATE.REGS[n->rs1] + NEXT_STATE.REGS[n->rs2];
+            break;
+    }
+
+    // The shell counts one instruction per cycle; account for the second.
+    INSTRUCTION_COUNT++;
+    fusion_hits[d->fusion]++;
+    return 1;
+}
+
+// Print how many retired instructions were executed as part of a fused pair
+void print_fusion_stats() {
+    unsigned long fused = 0;
+    int k;
+
+    printf("\nFused pairs (of %d instructions retired):\n", INSTRUCTION_COUNT);
+    printf("-------------------------------------\n");
+    for (k = FUSE_LUI_ADDI; k < FUSE_KINDS; k++) {
+        printf("%-12s: %lu\n", fusion_name[k], fusion_hits[k]);
+        fused += fusion_hits[k];
+    }
+    printf("Hit rate    : %.2f%%\n\n",
+           INSTRUCTION_COUNT ? 200.0 * fused / INSTRUCTION_COUNT : 0.0);
+}
+
 // Execute: Update the state according to the decoded instruction
 void execute() {
     switch (opcode) {
@@ -203,10 +363,16 @@ void execute() {
     }
 }
 
-// process_instruction: Fetch, decode, and execute one instruction
+// process_instruction: Fetch, decode, and execute one instruction, or
+// a fused pair when the shell allows more than one to retire
 void process_instruction() {
+    predecoded_t *d;
+
     // Begin with a fresh copy of the current state
     fetch();
-    decode();
+    d = predecode_lookup(CURRENT_STATE.PC, instruction);
+    if (RETIRE_LIMIT >= 2 && execute_fused(d))
+        return;
+    decode(d);
     execute();
 }